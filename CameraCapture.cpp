@@ -0,0 +1,154 @@
+#include "CameraCapture.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+CameraCapture::CameraCapture(const int cameraIndex)
+    : m_mailbox(2), m_measuredFrameRate(0), m_running(false), m_capturedFrames(0), m_droppedFrames(0)
+{
+    m_camera = std::make_unique<cv::VideoCapture>(cameraIndex);
+    if (m_camera->isOpened() == false)
+    {
+        return;
+    }
+
+#if CV_VERSION_MAJOR < 3
+    m_frameSize.width = (int)m_camera->get(cv::CAP_PROP_FRAME_WIDTH);
+    m_frameSize.height = (int)m_camera->get(cv::CAP_PROP_FRAME_HEIGHT);
+    double reportedFrameRate = m_camera->get(cv::CAP_PROP_FPS);
+#else
+    m_frameSize.width = (int)m_camera->get(CV_CAP_PROP_FRAME_WIDTH);
+    m_frameSize.height = (int)m_camera->get(CV_CAP_PROP_FRAME_HEIGHT);
+    double reportedFrameRate = m_camera->get(CV_CAP_PROP_FPS);
+#endif
+
+    // Many drivers report 0, -1 or garbage, those are measured instead
+    if (reportedFrameRate > 0 && reportedFrameRate <= 1000)
+    {
+        m_reportedFrameRate = reportedFrameRate;
+    }
+
+    m_running = true;
+    m_captureThread = std::thread(&CameraCapture::captureLoop, this);
+}
+
+CameraCapture::~CameraCapture()
+{
+    m_running = false;
+    notifyReader();
+    if (m_captureThread.joinable())
+    {
+        m_captureThread.join();
+    }
+}
+
+bool CameraCapture::isOpened() const
+{
+    return m_camera->isOpened();
+}
+
+cv::Size CameraCapture::frameSize() const
+{
+    return m_frameSize;
+}
+
+double CameraCapture::frameRate()
+{
+    if (m_reportedFrameRate > 0)
+    {
+        return m_reportedFrameRate;
+    }
+
+    std::unique_lock<std::mutex> lock(m_frameReadyMutex);
+    m_frameReady.wait(lock, [&] { return m_measuredFrameRate > 0 || !m_running; });
+    return m_measuredFrameRate;
+}
+
+bool CameraCapture::read(cv::Mat &frame, int64 &captureTicks)
+{
+    if ((m_mailbox.load(std::memory_order_acquire) & m_freshFrameFlag) == 0)
+    {
+        std::unique_lock<std::mutex> lock(m_frameReadyMutex);
+        m_frameReady.wait(lock, [&]
+        {
+            return (m_mailbox.load(std::memory_order_acquire) & m_freshFrameFlag) != 0 || !m_running;
+        });
+
+        if ((m_mailbox.load(std::memory_order_acquire) & m_freshFrameFlag) == 0)
+        {
+            frame.release();
+            return false;
+        }
+    }
+
+    // Hand our old slot back and take the fresh one
+    m_frontSlot = m_mailbox.exchange(m_frontSlot, std::memory_order_acq_rel) & m_slotIndexMask;
+
+    frame = m_slots[m_frontSlot].frame;
+    captureTicks = m_slots[m_frontSlot].captureTicks;
+    return true;
+}
+
+size_t CameraCapture::capturedFrames() const
+{
+    return m_capturedFrames;
+}
+
+size_t CameraCapture::droppedFrames() const
+{
+    return m_droppedFrames;
+}
+
+void CameraCapture::captureLoop()
+{
+    while (m_running)
+    {
+        // grab() only latches the frame so the timestamp is as close to exposure as we can get,
+        // decoding happens in retrieve()
+        if (!m_camera->grab())
+        {
+            break;
+        }
+        auto captureTicks = cv::getTickCount();
+
+        Slot &slot = m_slots[m_backSlot];
+        if (!m_camera->retrieve(slot.frame) || slot.frame.empty())
+        {
+            continue;
+        }
+        slot.captureTicks = captureTicks;
+        size_t capturedFrames = ++m_capturedFrames;
+
+        if (capturedFrames == 1)
+        {
+            m_firstFrameTicks = captureTicks;
+        }
+        else if (capturedFrames == m_frameRateSampleFrames + 1)
+        {
+            m_measuredFrameRate = m_frameRateSampleFrames * cv::getTickFrequency() / (captureTicks - m_firstFrameTicks);
+        }
+
+        // Publish the frame and take back whichever slot was in the mailbox
+        int previous = m_mailbox.exchange(m_backSlot | m_freshFrameFlag, std::memory_order_acq_rel);
+        if (previous & m_freshFrameFlag)
+        {
+            m_droppedFrames++;
+        }
+        m_backSlot = previous & m_slotIndexMask;
+
+        notifyReader();
+    }
+
+    m_running = false;
+    notifyReader();
+}
+
+void CameraCapture::notifyReader()
+{
+    // Taking the mutex orders the notification after the reader checked the mailbox, so the wakeup can't be missed.
+    // Both read() and frameRate() may be waiting
+    {
+        std::lock_guard<std::mutex> lock(m_frameReadyMutex);
+    }
+    m_frameReady.notify_all();
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace cv
+{
+    class VideoCapture;
+}
+
+/*
+ * Grabs camera frames on a dedicated thread and keeps only the newest one.
+ * Frames are passed to the reader through a lock-free triple buffer so the
+ * reader always gets the freshest frame and never waits on the driver queue
+ */
+class CameraCapture
+{
+public:
+    /*
+     * Opens camera with camera index and starts capture thread
+     */
+    CameraCapture(const int cameraIndex);
+    ~CameraCapture();
+
+    bool isOpened() const;
+
+    /*
+     * Size of frames returned by the camera
+     */
+    cv::Size frameSize() const;
+
+    /*
+     * Frames per second delivered by the camera. Uses the rate reported by the driver and,
+     * when the driver doesn't report one, waits until it has been measured over the first frames.
+     * Returns 0 if the camera stopped before the rate was known
+     */
+    double frameRate();
+
+    /*
+     * Waits for a frame newer than the last one read. The frame shares memory with
+     * the capture buffer and stays valid until the next call to read.
+     * captureTicks is set to cv::getTickCount() at the time the frame was grabbed.
+     * Returns false if the camera stopped delivering frames
+     */
+    bool read(cv::Mat &frame, int64 &captureTicks);
+
+    /*
+     * Number of frames grabbed by the capture thread
+     */
+    size_t capturedFrames() const;
+
+    /*
+     * Number of frames overwritten by a newer frame before they were read
+     */
+    size_t droppedFrames() const;
+
+private:
+    void captureLoop();
+
+    /* Wakes reader waiting in read() */
+    void notifyReader();
+
+    struct Slot
+    {
+        cv::Mat frame;
+        int64 captureTicks = 0;
+    };
+
+    /*
+     * Triple buffer. Capture thread writes to m_slots[m_backSlot], reader owns m_slots[m_frontSlot]
+     * and the remaining slot index is kept in m_mailbox together with the fresh frame flag
+     */
+    Slot m_slots[3];
+    int m_backSlot = 0;
+    int m_frontSlot = 1;
+    std::atomic<int> m_mailbox;
+
+    /*
+     * Only used to wake the reader when the mailbox was empty, frames are handed over through m_mailbox
+     */
+    std::mutex m_frameReadyMutex;
+    std::condition_variable m_frameReady;
+
+    static const int m_slotIndexMask = 0x3;
+    static const int m_freshFrameFlag = 0x4;
+
+    std::unique_ptr<cv::VideoCapture> m_camera;
+    cv::Size m_frameSize;
+
+    /*
+     * Rate reported by the driver, 0 if unknown, and rate measured by the capture thread, 0 until
+     * m_frameRateSampleFrames frames were captured
+     */
+    double m_reportedFrameRate = 0;
+    std::atomic<double> m_measuredFrameRate;
+    int64 m_firstFrameTicks = 0;
+    static const size_t m_frameRateSampleFrames = 30;
+
+    std::thread m_captureThread;
+    std::atomic<bool> m_running;
+
+    std::atomic<size_t> m_capturedFrames;
+    std::atomic<size_t> m_droppedFrames;
+};
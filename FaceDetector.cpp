@@ -0,0 +1,347 @@
+#include "FaceDetector.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/objdetect/objdetect.hpp>
+
+#include <dlib/opencv.h>
+#include <dlib/image_processing/frontal_face_detector.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+void FaceDetector::filterBySize(std::vector<cv::Rect> &faces, const cv::Size &minSize, const cv::Size &maxSize)
+{
+    faces.erase(std::remove_if(faces.begin(), faces.end(), [&](const cv::Rect &face)
+    {
+        return face.width < minSize.width || face.height < minSize.height ||
+            face.width > maxSize.width || face.height > maxSize.height;
+    }), faces.end());
+}
+
+/*
+ * CascadeFaceDetector
+ */
+
+CascadeFaceDetector::CascadeFaceDetector(const std::string cascadeFilePath, const std::string name)
+    : m_name(name)
+{
+    m_cascade = std::make_unique<cv::CascadeClassifier>(cascadeFilePath);
+    if (m_cascade->empty())
+    {
+        std::cerr << "Error loading cascade file " << cascadeFilePath << std::endl <<
+            "Make sure the file exists" << std::endl;
+    }
+}
+
+CascadeFaceDetector::~CascadeFaceDetector()
+{
+
+}
+
+void CascadeFaceDetector::detect(const cv::Mat &frame, std::vector<cv::Rect> &faces, const cv::Size &minSize, const cv::Size &maxSize)
+{
+    m_cascade->detectMultiScale(frame, faces, m_scaleFactor, m_minNeighbors, 0, minSize, maxSize);
+}
+
+bool CascadeFaceDetector::empty() const
+{
+    return m_cascade->empty();
+}
+
+std::string CascadeFaceDetector::name() const
+{
+    return m_name;
+}
+
+void CascadeFaceDetector::setScanParameters(double scaleFactor, int minNeighbors)
+{
+    m_scaleFactor = scaleFactor;
+    m_minNeighbors = minNeighbors;
+}
+
+/*
+ * DlibHogFaceDetector
+ */
+
+struct DlibHogFaceDetector::Impl
+{
+    dlib::frontal_face_detector detector = dlib::get_frontal_face_detector();
+};
+
+DlibHogFaceDetector::DlibHogFaceDetector()
+    : m_impl(std::make_unique<Impl>())
+{
+
+}
+
+DlibHogFaceDetector::~DlibHogFaceDetector()
+{
+
+}
+
+void DlibHogFaceDetector::detect(const cv::Mat &frame, std::vector<cv::Rect> &faces, const cv::Size &minSize, const cv::Size &maxSize)
+{
+    // HOG window is fixed at 80x80 so small faces are found only after upscaling the frame
+    double scale = 1.0;
+    if (minSize.width > 0 && minSize.width < m_hogWindowSize)
+    {
+        scale = (double)m_hogWindowSize / minSize.width;
+        cv::resize(frame, m_scaledFrame, cv::Size(), scale, scale);
+    }
+    else
+    {
+        m_scaledFrame = frame;
+    }
+
+    dlib::cv_image<dlib::bgr_pixel> dlibFrame(m_scaledFrame);
+    std::vector<dlib::rectangle> dlibFaces = m_impl->detector(dlibFrame);
+
+    // HOG boxes can extend past the image edge
+    faces.clear();
+    for (const auto &dlibFace : dlibFaces)
+    {
+        cv::Rect face = cv::Rect((int)(dlibFace.left() / scale), (int)(dlibFace.top() / scale),
+            (int)(dlibFace.width() / scale), (int)(dlibFace.height() / scale)) & cv::Rect(0, 0, frame.cols, frame.rows);
+        if (face.area() > 0)
+        {
+            faces.push_back(face);
+        }
+    }
+
+    filterBySize(faces, minSize, maxSize);
+}
+
+bool DlibHogFaceDetector::empty() const
+{
+    return false;
+}
+
+std::string DlibHogFaceDetector::name() const
+{
+    return "hog";
+}
+
+/*
+ * DnnFaceDetector
+ */
+
+#ifdef FACESWAP_HAVE_DNN
+DnnFaceDetector::DnnFaceDetector(const std::string prototxtPath, const std::string modelPath)
+{
+    try
+    {
+        m_net = cv::dnn::readNetFromCaffe(prototxtPath, modelPath);
+        m_net.setPreferableBackend(cv::dnn::DNN_BACKEND_DEFAULT);
+        m_net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+    }
+    catch (cv::Exception &e)
+    {
+        std::cerr << "Error loading DNN face model " << prototxtPath << ", " << modelPath << std::endl <<
+            "Make sure the files exist" << std::endl;
+    }
+}
+
+DnnFaceDetector::~DnnFaceDetector()
+{
+
+}
+
+void DnnFaceDetector::detect(const cv::Mat &frame, std::vector<cv::Rect> &faces, const cv::Size &minSize, const cv::Size &maxSize)
+{
+    cv::Mat blob = cv::dnn::blobFromImage(frame, 1.0, cv::Size(m_inputSize, m_inputSize), cv::Scalar(104, 177, 123), false, false);
+    m_net.setInput(blob);
+    cv::Mat output = m_net.forward();
+
+    // Output is 1x1xNx7 where each row is [image_id, label, confidence, left, top, right, bottom]
+    cv::Mat detections(output.size[2], output.size[3], CV_32F, output.ptr<float>());
+
+    faces.clear();
+    for (int i = 0; i < detections.rows; i++)
+    {
+        const float *detection = detections.ptr<float>(i);
+        if (detection[2] < m_confidenceThreshold)
+        {
+            continue;
+        }
+
+        cv::Point tl((int)(detection[3] * frame.cols), (int)(detection[4] * frame.rows));
+        cv::Point br((int)(detection[5] * frame.cols), (int)(detection[6] * frame.rows));
+        cv::Rect face = cv::Rect(tl, br) & cv::Rect(0, 0, frame.cols, frame.rows);
+        if (face.area() > 0)
+        {
+            faces.push_back(face);
+        }
+    }
+
+    filterBySize(faces, minSize, maxSize);
+}
+
+bool DnnFaceDetector::empty() const
+{
+    return m_net.empty();
+}
+
+std::string DnnFaceDetector::name() const
+{
+    return "dnn";
+}
+#endif
+
+/*
+ * Backend selection
+ */
+
+/* Returns model files needed by backend */
+static std::vector<std::string> faceDetectorModelFiles(const std::string &backend, const std::string &modelDirectory)
+{
+    if (backend == "haar")
+    {
+        return { modelDirectory + "haarcascade_frontalface_default.xml" };
+    }
+    if (backend == "lbp")
+    {
+        return { modelDirectory + "lbpcascade_frontalface.xml" };
+    }
+    if (backend == "dnn")
+    {
+        return { modelDirectory + "deploy.prototxt", modelDirectory + "res10_300x300_ssd_iter_140000.caffemodel" };
+    }
+    return {};
+}
+
+std::unique_ptr<FaceDetector> createFaceDetector(const std::string &backend, const std::string &modelDirectory)
+{
+    const auto modelFiles = faceDetectorModelFiles(backend, modelDirectory);
+
+    if (backend == "haar" || backend == "lbp")
+    {
+        return std::make_unique<CascadeFaceDetector>(modelFiles[0], backend);
+    }
+    if (backend == "hog")
+    {
+        return std::make_unique<DlibHogFaceDetector>();
+    }
+#ifdef FACESWAP_HAVE_DNN
+    if (backend == "dnn")
+    {
+        return std::make_unique<DnnFaceDetector>(modelFiles[0], modelFiles[1]);
+    }
+#endif
+    return nullptr;
+}
+
+bool isFaceDetectorAvailable(const std::string &backend, const std::string &modelDirectory)
+{
+#ifndef FACESWAP_HAVE_DNN
+    if (backend == "dnn")
+    {
+        return false;
+    }
+#endif
+    if (backend != "haar" && backend != "lbp" && backend != "hog" && backend != "dnn")
+    {
+        return false;
+    }
+
+    const auto modelFiles = faceDetectorModelFiles(backend, modelDirectory);
+    return std::all_of(modelFiles.begin(), modelFiles.end(), [](const std::string &path)
+    {
+        return std::ifstream(path).good();
+    });
+}
+
+/*
+ * Returns true if face and referenceFace are the same face. Backends frame faces differently
+ * (DNN boxes include the forehead, HOG boxes are tight) so overlap ratios are unreliable.
+ * Instead the face center must lie inside the reference box and widths must be within 2x
+ */
+static bool isSameFace(const cv::Rect &face, const cv::Rect &referenceFace)
+{
+    const cv::Point center(face.x + face.width / 2, face.y + face.height / 2);
+    return referenceFace.contains(center) &&
+        face.width <= referenceFace.width * 2 && referenceFace.width <= face.width * 2;
+}
+
+std::unique_ptr<FaceDetector> selectFastestFaceDetector(std::vector<std::unique_ptr<FaceDetector>> candidates,
+    const std::vector<cv::Mat> &sampleFrames, const cv::Size &minSize, const cv::Size &maxSize, double minRecall)
+{
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [](const std::unique_ptr<FaceDetector> &candidate)
+    {
+        return !candidate || candidate->empty();
+    }), candidates.end());
+
+    if (candidates.empty())
+    {
+        return nullptr;
+    }
+    if (sampleFrames.empty())
+    {
+        return std::move(candidates.front());
+    }
+
+    // Faces found by the reference detector on each sample frame
+    std::vector<std::vector<cv::Rect>> referenceFaces(sampleFrames.size());
+    size_t numReferenceFaces = 0;
+
+    size_t bestIndex = 0;
+    double bestTime = std::numeric_limits<double>::max();
+
+    std::vector<cv::Rect> faces;
+    for (size_t c = 0; c < candidates.size(); c++)
+    {
+        auto &candidate = candidates[c];
+
+        // Warm up so lazy initialization isn't timed
+        candidate->detect(sampleFrames.front(), faces, minSize, maxSize);
+
+        double totalTime = 0;
+        size_t numMatched = 0;
+        for (size_t f = 0; f < sampleFrames.size(); f++)
+        {
+            auto timeStart = cv::getTickCount();
+            candidate->detect(sampleFrames[f], faces, minSize, maxSize);
+            totalTime += (cv::getTickCount() - timeStart) / cv::getTickFrequency();
+
+            if (c == 0)
+            {
+                referenceFaces[f] = faces;
+                numReferenceFaces += faces.size();
+                continue;
+            }
+
+            for (const auto &referenceFace : referenceFaces[f])
+            {
+                bool matched = std::any_of(faces.begin(), faces.end(), [&](const cv::Rect &face)
+                {
+                    return isSameFace(face, referenceFace);
+                });
+                if (matched)
+                {
+                    numMatched++;
+                }
+            }
+        }
+
+        double timePerFrame = totalTime / sampleFrames.size();
+        double recall = (c == 0 || numReferenceFaces == 0) ? 1.0 : (double)numMatched / numReferenceFaces;
+
+        std::cout << "Detector " << candidate->name() << ": " << timePerFrame * 1000 << " ms/frame, recall " << recall << std::endl;
+
+        if (recall >= minRecall && timePerFrame < bestTime)
+        {
+            bestTime = timePerFrame;
+            bestIndex = c;
+        }
+    }
+
+    if (numReferenceFaces == 0)
+    {
+        std::cerr << "Reference detector found no faces in sample frames, recall could not be measured" << std::endl;
+    }
+
+    std::cout << "Selected detector " << candidates[bestIndex]->name() << std::endl;
+    return std::move(candidates[bestIndex]);
+}
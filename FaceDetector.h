@@ -0,0 +1,138 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+#include <string>
+#include <memory>
+
+namespace cv
+{
+    class CascadeClassifier;
+}
+
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 3)
+#define FACESWAP_HAVE_DNN 1
+#include <opencv2/dnn/dnn.hpp>
+#endif
+
+/*
+ * Interface for face detection backends used by FaceDetectorAndTracker
+ */
+class FaceDetector
+{
+public:
+    virtual ~FaceDetector() {}
+
+    /*
+     * Detects faces on frame. Only faces between minSize and maxSize are returned
+     */
+    virtual void detect(const cv::Mat &frame, std::vector<cv::Rect> &faces, const cv::Size &minSize, const cv::Size &maxSize) = 0;
+
+    /*
+     * Returns true if the backend failed to load its model
+     */
+    virtual bool empty() const = 0;
+
+    /*
+     * Returns backend name used in logs
+     */
+    virtual std::string name() const = 0;
+
+    /*
+     * Sets multi-scale scan step and minimum neighbor count. Backends without a cascade scan ignore them
+     */
+    virtual void setScanParameters(double scaleFactor, int minNeighbors) {}
+
+protected:
+    /* Removes faces smaller than minSize or bigger than maxSize */
+    static void filterBySize(std::vector<cv::Rect> &faces, const cv::Size &minSize, const cv::Size &maxSize);
+};
+
+/*
+ * Viola-Jones cascade detector. Works with both Haar and LBP cascade files
+ */
+class CascadeFaceDetector : public FaceDetector
+{
+public:
+    CascadeFaceDetector(const std::string cascadeFilePath, const std::string name);
+    ~CascadeFaceDetector();
+
+    void detect(const cv::Mat &frame, std::vector<cv::Rect> &faces, const cv::Size &minSize, const cv::Size &maxSize) override;
+    bool empty() const override;
+    std::string name() const override;
+    void setScanParameters(double scaleFactor, int minNeighbors) override;
+
+private:
+    std::unique_ptr<cv::CascadeClassifier> m_cascade;
+    std::string m_name;
+
+    double m_scaleFactor = 1.1;
+    int m_minNeighbors = 3;
+};
+
+/*
+ * dlib HOG + linear SVM frontal face detector
+ */
+class DlibHogFaceDetector : public FaceDetector
+{
+public:
+    DlibHogFaceDetector();
+    ~DlibHogFaceDetector();
+
+    void detect(const cv::Mat &frame, std::vector<cv::Rect> &faces, const cv::Size &minSize, const cv::Size &maxSize) override;
+    bool empty() const override;
+    std::string name() const override;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> m_impl;
+
+    /*
+     * Smallest face the HOG detector can find. Frames are upscaled so minSize maps to at least this size
+     */
+    static const int m_hogWindowSize = 80;
+
+    cv::Mat m_scaledFrame;
+};
+
+#ifdef FACESWAP_HAVE_DNN
+/*
+ * OpenCV DNN SSD face detector (res10_300x300 Caffe model) running on CPU
+ */
+class DnnFaceDetector : public FaceDetector
+{
+public:
+    DnnFaceDetector(const std::string prototxtPath, const std::string modelPath);
+    ~DnnFaceDetector();
+
+    void detect(const cv::Mat &frame, std::vector<cv::Rect> &faces, const cv::Size &minSize, const cv::Size &maxSize) override;
+    bool empty() const override;
+    std::string name() const override;
+
+private:
+    cv::dnn::Net m_net;
+
+    const float m_confidenceThreshold = 0.5f;
+    const int m_inputSize = 300;
+};
+#endif
+
+/*
+ * Creates detector backend by name. Supported names are "haar", "lbp", "hog" and "dnn".
+ * Returns nullptr for unknown names. Model files are searched for in modelDirectory
+ */
+std::unique_ptr<FaceDetector> createFaceDetector(const std::string &backend, const std::string &modelDirectory);
+
+/*
+ * Returns true if backend is supported by this build and its model files exist in modelDirectory.
+ * Lets callers skip unavailable backends without the loading errors createFaceDetector prints
+ */
+bool isFaceDetectorAvailable(const std::string &backend, const std::string &modelDirectory);
+
+/*
+ * Times each candidate on sampleFrames and returns the fastest one whose recall is at least minRecall.
+ * Candidates should be ordered from most to least accurate, the first one is used as the recall reference.
+ * Candidates that failed to load are skipped
+ */
+std::unique_ptr<FaceDetector> selectFastestFaceDetector(std::vector<std::unique_ptr<FaceDetector>> candidates,
+    const std::vector<cv::Mat> &sampleFrames, const cv::Size &minSize, const cv::Size &maxSize, double minRecall);
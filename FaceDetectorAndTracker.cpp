@@ -1,4 +1,6 @@
 #include "FaceDetectorAndTracker.h"
+#include "FaceDetector.h"
+#include "CameraCapture.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/video/video.hpp>
@@ -6,38 +8,51 @@
 #include <opencv2/objdetect/objdetect.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 
 FaceDetectorAndTracker::FaceDetectorAndTracker(const std::string cascadeFilePath, const int cameraIndex, size_t numFaces)
+    : FaceDetectorAndTracker(std::make_unique<CascadeFaceDetector>(cascadeFilePath, "haar"), cameraIndex, numFaces)
 {
-    m_camera = std::make_unique<cv::VideoCapture>(cameraIndex);
-    if (m_camera->isOpened() == false)
+
+}
+
+FaceDetectorAndTracker::FaceDetectorAndTracker(std::unique_ptr<FaceDetector> detector, const int cameraIndex, size_t numFaces)
+{
+    init(cameraIndex, numFaces);
+
+    m_detector = std::move(detector);
+    if (!m_detector || m_detector->empty())
     {
-        std::cerr << "Failed opening camera" << std::endl;
+        std::cerr << "Error loading face detector" << std::endl;
         exit(-1);
     }
+}
 
-    m_faceCascade = std::make_unique<cv::CascadeClassifier>(cascadeFilePath);
-    if (m_faceCascade->empty())
+FaceDetectorAndTracker::FaceDetectorAndTracker(std::vector<std::unique_ptr<FaceDetector>> candidates, size_t numSampleFrames, double minRecall,
+    const int cameraIndex, size_t numFaces)
+{
+    init(cameraIndex, numFaces);
+
+    calibrate(std::move(candidates), numSampleFrames, minRecall);
+    if (!m_detector)
     {
-        std::cerr << "Error loading cascade file " << cascadeFilePath << std::endl << 
-            "Make sure the file exists" << std::endl;
         exit(-1);
     }
+}
 
-#if CV_VERSION_MAJOR < 3
-    m_originalFrameSize.width = (int)m_camera->get(cv::CAP_PROP_FRAME_WIDTH);
-    m_originalFrameSize.height = (int)m_camera->get(cv::CAP_PROP_FRAME_HEIGHT);
-#else
-    m_originalFrameSize.width = (int)m_camera->get(CV_CAP_PROP_FRAME_WIDTH);
-    m_originalFrameSize.height = (int)m_camera->get(CV_CAP_PROP_FRAME_HEIGHT);
-#endif
-
-    m_downscaledFrameSize.width = m_downscaledFrameWidth;
-    m_downscaledFrameSize.height = (m_downscaledFrameSize.width * m_originalFrameSize.height) / m_originalFrameSize.width;
+void FaceDetectorAndTracker::init(const int cameraIndex, size_t numFaces)
+{
+    m_camera = std::make_unique<CameraCapture>(cameraIndex);
+    if (m_camera->isOpened() == false)
+    {
+        std::cerr << "Failed opening camera" << std::endl;
+        exit(-1);
+    }
 
-    m_ratio.x = (float)m_originalFrameSize.width / m_downscaledFrameSize.width;
-    m_ratio.y = (float)m_originalFrameSize.height / m_downscaledFrameSize.height;
+    m_originalFrameSize = m_camera->frameSize();
+    updateDownscaledFrameSize();
 
     m_numFaces = numFaces;
 }
@@ -49,24 +64,101 @@ FaceDetectorAndTracker::~FaceDetectorAndTracker()
 
 void FaceDetectorAndTracker::operator>>(cv::Mat &frame)
 {
-    if (m_camera->isOpened() == false)
+    if (m_camera->read(frame, m_frameCaptureTicks) == false)
     {
-        frame.release(); 
         return;
     }
-    *m_camera >> frame;
+
+    auto timeStart = cv::getTickCount();
 
     cv::resize(frame, m_downscaledFrame, m_downscaledFrameSize);
 
-    if (!m_tracking) // Search for faces on whole frame until 2 faces are found
+    if (!m_tracking && m_faceMotions.size() == m_numFaces) // Faces were lost, search where motion models predict them
+    {
+        recover();
+    }
+    else if (!m_tracking) // Search for faces on whole frame until 2 faces are found
     {
         detect();
-        return;
     }
     else // if (m_tracking)
     {
         track();
     }
+
+    m_detectionTime = (cv::getTickCount() - timeStart) / cv::getTickFrequency();
+}
+
+double FaceDetectorAndTracker::detectionTime() const
+{
+    return m_detectionTime;
+}
+
+void FaceDetectorAndTracker::setDownscaledFrameWidth(int width)
+{
+    if (width == m_downscaledFrameWidth || width <= 0)
+    {
+        return;
+    }
+
+    const double scale = (double)width / m_downscaledFrameWidth;
+    m_downscaledFrameWidth = width;
+    updateDownscaledFrameSize();
+
+    // Move motion models and templates to the new resolution so recover() finds faces without full frame search
+    for (auto& motion : m_faceMotions)
+    {
+        motion.statePost *= scale;
+        motion.errorCovPost *= scale * scale;
+    }
+    for (auto& faceTemplate : m_faceTemplates)
+    {
+        cv::Size templateSize(std::max((int)(faceTemplate.cols * scale), 1), std::max((int)(faceTemplate.rows * scale), 1));
+        cv::resize(faceTemplate, faceTemplate, templateSize);
+    }
+
+    loseFaces();
+}
+
+void FaceDetectorAndTracker::setScanParameters(double scaleFactor, int minNeighbors)
+{
+    m_scaleFactor = scaleFactor;
+    m_minNeighbors = minNeighbors;
+    m_detector->setScanParameters(m_scaleFactor, m_minNeighbors);
+}
+
+void FaceDetectorAndTracker::updateDownscaledFrameSize()
+{
+    m_downscaledFrameSize.width = m_downscaledFrameWidth;
+    m_downscaledFrameSize.height = (m_downscaledFrameSize.width * m_originalFrameSize.height) / m_originalFrameSize.width;
+
+    m_ratio.x = (float)m_originalFrameSize.width / m_downscaledFrameSize.width;
+    m_ratio.y = (float)m_originalFrameSize.height / m_downscaledFrameSize.height;
+}
+
+cv::Size FaceDetectorAndTracker::frameSize() const
+{
+    return m_originalFrameSize;
+}
+
+double FaceDetectorAndTracker::frameRate() const
+{
+    return m_camera->frameRate();
+}
+
+int64 FaceDetectorAndTracker::frameCaptureTicks() const
+{
+    return m_frameCaptureTicks;
+}
+
+size_t FaceDetectorAndTracker::droppedFrames() const
+{
+    return m_camera->droppedFrames();
+}
+
+size_t FaceDetectorAndTracker::capturedFrames() const
+{
+    return m_camera->capturedFrames();
 }
 
 std::vector<cv::Rect> FaceDetectorAndTracker::faces()
@@ -79,13 +171,55 @@ std::vector<cv::Rect> FaceDetectorAndTracker::faces()
     return faces;
 }
 
-void FaceDetectorAndTracker::detect()
+void FaceDetectorAndTracker::calibrate(std::vector<std::unique_ptr<FaceDetector>> candidates, size_t numSampleFrames, double minRecall)
+{
+    std::vector<cv::Mat> sampleFrames;
+    cv::Mat frame;
+    int64 captureTicks;
+    for (size_t i = 0; i < numSampleFrames; i++)
+    {
+        if (m_camera->read(frame, captureTicks) == false)
+        {
+            break;
+        }
+        cv::Mat downscaledFrame;
+        cv::resize(frame, downscaledFrame, m_downscaledFrameSize);
+        sampleFrames.push_back(downscaledFrame);
+    }
+
+    auto detector = selectFastestFaceDetector(std::move(candidates), sampleFrames, minFaceSize(), maxFaceSize(), minRecall);
+    if (!detector)
+    {
+        std::cerr << "No face detector candidate could be loaded" << std::endl;
+        if (m_detector)
+        {
+            std::cerr << "Keeping " << m_detector->name() << std::endl;
+        }
+        return;
+    }
+
+    m_detector = std::move(detector);
+    m_detector->setScanParameters(m_scaleFactor, m_minNeighbors);
+    m_facesRects.clear();
+    m_faceMotions.clear();
+    m_tracking = false;
+}
+
+cv::Size FaceDetectorAndTracker::minFaceSize() const
 {
     // Minimum face size is 1/5th of screen height
+    return cv::Size(m_downscaledFrameSize.height / 5, m_downscaledFrameSize.height / 5);
+}
+
+cv::Size FaceDetectorAndTracker::maxFaceSize() const
+{
     // Maximum face size is 2/3rds of screen height
-    m_faceCascade->detectMultiScale(m_downscaledFrame, m_facesRects, 1.1, 3, 0,
-        cv::Size(m_downscaledFrame.rows / 5, m_downscaledFrame.rows / 5),
-        cv::Size(m_downscaledFrame.rows * 2 / 3, m_downscaledFrame.rows * 2 / 3));
+    return cv::Size(m_downscaledFrameSize.height * 2 / 3, m_downscaledFrameSize.height * 2 / 3);
+}
+
+void FaceDetectorAndTracker::detect()
+{
+    m_detector->detect(m_downscaledFrame, m_facesRects, minFaceSize(), maxFaceSize());
 
     if (m_facesRects.size() < m_numFaces)
     {
@@ -96,15 +230,128 @@ void FaceDetectorAndTracker::detect()
         m_facesRects.resize(m_numFaces);
     }
 
+    // New identities, start motion models from scratch
+    m_faceMotions.clear();
+    for (const auto& face : m_facesRects)
+    {
+        m_faceMotions.push_back(createMotionModel(face));
+    }
+
+    startTracking();
+}
+
+void FaceDetectorAndTracker::recover()
+{
+    m_recoveryFrames++;
+
+    // Search around predicted face positions. Search region grows the longer faces are lost.
+    // Full frame search is the last resort once faces have been lost for too long
+    const bool searchFullFrame = m_recoveryFrames > m_maxRecoveryFrames;
+    const double searchScale = std::min(2.0 + m_recoveryFrames * m_recoverySearchGrowth, m_maxRecoverySearchScale);
+
+    std::vector<cv::Rect> predictedFaces;
+    for (auto& motion : m_faceMotions)
+    {
+        predictedFaces.push_back(rectFromState(motion.predict()));
+    }
+
+    std::vector<cv::Rect> candidates;
+    if (searchFullFrame)
+    {
+        m_detector->detect(m_downscaledFrame, candidates, minFaceSize(), maxFaceSize());
+    }
+    else
+    {
+        for (const auto& predicted : predictedFaces)
+        {
+            const cv::Rect roi = scaleRect(predicted, searchScale, m_downscaledFrameSize);
+            if (roi.width < minFaceSize().width || roi.height < minFaceSize().height)
+            {
+                continue;
+            }
+
+            // Detect faces sized 2/3 to 3/2 of the predicted face
+            m_detector->detect(m_downscaledFrame(roi), m_tmpFacesRect,
+                cv::Size(predicted.width * 2 / 3, predicted.height * 2 / 3),
+                cv::Size(predicted.width * 3 / 2, predicted.height * 3 / 2));
+
+            for (auto face : m_tmpFacesRect)
+            {
+                face.x += roi.x;
+                face.y += roi.y;
+
+                // Search regions of nearby faces overlap, don't add the same face twice
+                bool duplicate = std::any_of(candidates.begin(), candidates.end(), [&](const cv::Rect &candidate)
+                {
+                    return (candidate & face).area() > 0;
+                });
+                if (!duplicate)
+                {
+                    candidates.push_back(face);
+                }
+            }
+        }
+    }
+
+    if (candidates.size() < m_numFaces)
+    {
+        return;
+    }
+
+    // Re-associate identities greedily, cheapest face/candidate pair first.
+    // Cost is distance from predicted center relative to face size plus appearance difference
+    std::vector<std::vector<double>> costs(m_numFaces, std::vector<double>(candidates.size()));
+    for (size_t i = 0; i < m_numFaces; i++)
+    {
+        const cv::Rect &predicted = predictedFaces[i];
+        const cv::Point2f predictedCenter(predicted.x + predicted.width * 0.5f, predicted.y + predicted.height * 0.5f);
+        for (size_t c = 0; c < candidates.size(); c++)
+        {
+            const cv::Point2f candidateCenter(candidates[c].x + candidates[c].width * 0.5f, candidates[c].y + candidates[c].height * 0.5f);
+            double distance = cv::norm(candidateCenter - predictedCenter) / std::max(predicted.width, 1);
+            costs[i][c] = distance + m_appearanceWeight * appearanceCost(i, candidates[c]);
+        }
+    }
+
+    std::vector<bool> faceAssigned(m_numFaces, false);
+    std::vector<bool> candidateAssigned(candidates.size(), false);
+    m_facesRects.resize(m_numFaces);
+    for (size_t n = 0; n < m_numFaces; n++)
+    {
+        size_t bestFace = 0, bestCandidate = 0;
+        double bestCost = std::numeric_limits<double>::max();
+        for (size_t i = 0; i < m_numFaces; i++)
+        {
+            for (size_t c = 0; c < candidates.size(); c++)
+            {
+                if (!faceAssigned[i] && !candidateAssigned[c] && costs[i][c] < bestCost)
+                {
+                    bestCost = costs[i][c];
+                    bestFace = i;
+                    bestCandidate = c;
+                }
+            }
+        }
+        faceAssigned[bestFace] = candidateAssigned[bestCandidate] = true;
+        m_facesRects[bestFace] = candidates[bestCandidate];
+    }
+
+    for (size_t i = 0; i < m_numFaces; i++)
+    {
+        m_faceMotions[i].correct(measurementFromRect(m_facesRects[i]));
+    }
+
+    startTracking();
+}
+
+void FaceDetectorAndTracker::startTracking()
+{
     // Get face templates
     m_faceTemplates.clear();
-    for (auto face : m_facesRects)
+    for (const auto& face : m_facesRects)
     {
-        face.width /= 2;
-        face.height /= 2;
-        face.x += face.width / 2;
-        face.y += face.height / 2;
-        m_faceTemplates.push_back(m_downscaledFrame(face).clone());
+        // Faces cut off by the frame border keep only the visible part, track() drops empty templates
+        m_faceTemplates.push_back(m_downscaledFrame(templateRect(face) & cv::Rect(cv::Point(0, 0), m_downscaledFrameSize)).clone());
     }
 
     // Get face ROIs
@@ -123,18 +370,40 @@ void FaceDetectorAndTracker::detect()
     m_tmEndTime.resize(m_facesRects.size());
 
     // Turn on tracking
+    m_recoveryFrames = 0;
     m_tracking = true;
 }
 
+void FaceDetectorAndTracker::loseFaces()
+{
+    // Motion models and templates are kept so recover() knows where to look and who is who
+    m_facesRects.clear();
+    m_recoveryFrames = 0;
+    m_tracking = false;
+}
+
 void FaceDetectorAndTracker::track()
 {
+    // Move search regions to where the motion models expect the faces
+    for (int i = 0; i < m_faceRois.size(); i++)
+    {
+        m_faceRois[i] = doubleRectSize(rectFromState(m_faceMotions[i].predict()), m_downscaledFrameSize);
+    }
+
     for (int i = 0; i < m_faceRois.size(); i++)
     {
         const auto &roi = m_faceRois[i]; // roi
 
+        // Face predicted to leave the frame
+        if (roi.width < m_faceTemplates[i].cols || roi.height < m_faceTemplates[i].rows)
+        {
+            loseFaces();
+            return;
+        }
+
         // Detect faces sized +/-20% off biggest face in previous search
         const cv::Mat &faceRoi = m_downscaledFrame(roi);
-        m_faceCascade->detectMultiScale(faceRoi, m_tmpFacesRect, 1.1, 3, 0,
+        m_detector->detect(faceRoi, m_tmpFacesRect,
             cv::Size(roi.width * 4 / 10, roi.height * 4 / 10),
             cv::Size(roi.width * 6 / 10, roi.width * 6 / 10));
 
@@ -147,8 +416,7 @@ void FaceDetectorAndTracker::track()
             
             if (m_faceTemplates[i].cols <= 1 || m_faceTemplates[i].rows <= 1)
             {
-                m_facesRects.clear();
-                m_tracking = false;
+                loseFaces();
                 return;
             }
 
@@ -171,8 +439,7 @@ void FaceDetectorAndTracker::track()
             double duration = (double)(m_tmEndTime[i] - m_tmStartTime[i]) / cv::getTickFrequency();
             if (duration > m_tmMaxDuration)
             {
-                m_facesRects.clear();
-                m_tracking = false;
+                loseFaces();
                 return; // Stop tracking faces
             }
         }
@@ -186,6 +453,8 @@ void FaceDetectorAndTracker::track()
             m_facesRects[i].x += roi.x;
             m_facesRects[i].y += roi.y;
         }
+
+        m_faceMotions[i].correct(measurementFromRect(m_facesRects[i]));
     }
 
     for (int i = 0; i < m_facesRects.size(); i++)
@@ -194,24 +463,103 @@ void FaceDetectorAndTracker::track()
         {
             if ((m_facesRects[i] & m_facesRects[j]).area() > 0)
             {
-                m_facesRects.clear();
-                m_tracking = false;
+                loseFaces();
                 return;
             }
         }
     }
 }
 
+double FaceDetectorAndTracker::appearanceCost(size_t faceIndex, const cv::Rect &candidate)
+{
+    const cv::Mat &faceTemplate = m_faceTemplates[faceIndex];
+    const cv::Rect candidateRect = templateRect(candidate) & cv::Rect(cv::Point(0, 0), m_downscaledFrameSize);
+    if (faceTemplate.empty() || candidateRect.area() == 0)
+    {
+        return 1.0;
+    }
+
+    // Compare at template size, result is a single normalized squared difference
+    cv::resize(m_downscaledFrame(candidateRect), m_candidateTemplate, faceTemplate.size());
+    cv::matchTemplate(m_candidateTemplate, faceTemplate, m_matchingResult, CV_TM_SQDIFF_NORMED);
+    return m_matchingResult.at<float>(0, 0);
+}
+
+cv::KalmanFilter FaceDetectorAndTracker::createMotionModel(const cv::Rect &face)
+{
+    // State is [cx, cy, vx, vy, w, h], measurement is [cx, cy, w, h]
+    cv::KalmanFilter motion(6, 4, 0, CV_32F);
+
+    cv::setIdentity(motion.transitionMatrix);
+    motion.transitionMatrix.at<float>(0, 2) = 1.0f;
+    motion.transitionMatrix.at<float>(1, 3) = 1.0f;
+
+    motion.measurementMatrix = cv::Mat::zeros(4, 6, CV_32F);
+    motion.measurementMatrix.at<float>(0, 0) = 1.0f;
+    motion.measurementMatrix.at<float>(1, 1) = 1.0f;
+    motion.measurementMatrix.at<float>(2, 4) = 1.0f;
+    motion.measurementMatrix.at<float>(3, 5) = 1.0f;
+
+    // Units are downscaled frame pixels per frame
+    cv::setIdentity(motion.processNoiseCov, cv::Scalar::all(1.0));
+    motion.processNoiseCov.at<float>(2, 2) = 0.25f;
+    motion.processNoiseCov.at<float>(3, 3) = 0.25f;
+    motion.processNoiseCov.at<float>(4, 4) = 0.5f;
+    motion.processNoiseCov.at<float>(5, 5) = 0.5f;
+    cv::setIdentity(motion.measurementNoiseCov, cv::Scalar::all(2.0));
+
+    cv::setIdentity(motion.errorCovPost, cv::Scalar::all(10.0));
+    motion.errorCovPost.at<float>(2, 2) = 100.0f;
+    motion.errorCovPost.at<float>(3, 3) = 100.0f;
+
+    motion.statePost.at<float>(0) = face.x + face.width * 0.5f;
+    motion.statePost.at<float>(1) = face.y + face.height * 0.5f;
+    motion.statePost.at<float>(2) = 0.0f;
+    motion.statePost.at<float>(3) = 0.0f;
+    motion.statePost.at<float>(4) = (float)face.width;
+    motion.statePost.at<float>(5) = (float)face.height;
+
+    return motion;
+}
+
+cv::Rect FaceDetectorAndTracker::rectFromState(const cv::Mat &state)
+{
+    const float width = std::max(state.at<float>(4), 1.0f);
+    const float height = std::max(state.at<float>(5), 1.0f);
+    return cv::Rect(cvRound(state.at<float>(0) - width * 0.5f), cvRound(state.at<float>(1) - height * 0.5f),
+        cvRound(width), cvRound(height));
+}
+
+cv::Mat FaceDetectorAndTracker::measurementFromRect(const cv::Rect &face)
+{
+    return (cv::Mat_<float>(4, 1) << face.x + face.width * 0.5f, face.y + face.height * 0.5f, (float)face.width, (float)face.height);
+}
+
+cv::Rect FaceDetectorAndTracker::templateRect(cv::Rect face)
+{
+    // Template is the inner half of the face
+    face.width /= 2;
+    face.height /= 2;
+    face.x += face.width / 2;
+    face.y += face.height / 2;
+    return face;
+}
+
 cv::Rect FaceDetectorAndTracker::doubleRectSize(const cv::Rect &inputRect, const cv::Size &frameSize)
+{
+    return scaleRect(inputRect, 2.0, frameSize);
+}
+
+cv::Rect FaceDetectorAndTracker::scaleRect(const cv::Rect &inputRect, double scale, const cv::Size &frameSize)
 {
     cv::Rect outputRect;
-    // Double rect size
-    outputRect.width = inputRect.width * 2;
-    outputRect.height = inputRect.height * 2;
+    // Scale rect size
+    outputRect.width = (int)(inputRect.width * scale);
+    outputRect.height = (int)(inputRect.height * scale);
 
     // Center rect around original center
-    outputRect.x = inputRect.x - inputRect.width / 2;
-    outputRect.y = inputRect.y - inputRect.height / 2;
+    outputRect.x = inputRect.x + (inputRect.width - outputRect.width) / 2;
+    outputRect.y = inputRect.y + (inputRect.height - outputRect.height) / 2;
 
     // Handle edge cases
     if (outputRect.x < 0) {
@@ -230,5 +578,10 @@ cv::Rect FaceDetectorAndTracker::doubleRectSize(const cv::Rect &inputRect, const
         outputRect.height = frameSize.height - outputRect.y;
     }
 
+    // Rect is completely outside of frame
+    if (outputRect.width < 0 || outputRect.height < 0) {
+        outputRect = cv::Rect();
+    }
+
     return outputRect;
 }
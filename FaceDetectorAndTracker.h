@@ -1,16 +1,13 @@
 #pragma once
 
 #include <opencv2/core/core.hpp>
+#include <opencv2/video/tracking.hpp>
 #include <vector>
 #include <string>
 #include <memory>
 
-namespace cv
-{
-    class VideoCapture;
-    class CascadeClassifier;
-}
-
+class FaceDetector;
+class CameraCapture;
 
 
 class FaceDetectorAndTracker
@@ -20,38 +17,139 @@ public:
      * Initializes detector with cascade file, initializes camera with camera index and sets number of faces to track
      */
     FaceDetectorAndTracker(const std::string cascadeFilePath, const int cameraIndex, size_t numFaces);
+
+    /*
+     * Initializes with given detector backend, initializes camera with camera index and sets number of faces to track
+     */
+    FaceDetectorAndTracker(std::unique_ptr<FaceDetector> detector, const int cameraIndex, size_t numFaces);
+
+    /*
+     * Initializes camera with camera index, sets number of faces to track and picks the detector
+     * from candidates with calibrate(). Exits if none of the candidates loaded
+     */
+    FaceDetectorAndTracker(std::vector<std::unique_ptr<FaceDetector>> candidates, size_t numSampleFrames, double minRecall,
+        const int cameraIndex, size_t numFaces);
     ~FaceDetectorAndTracker();
 
     /*
-     * Returns next camera frame and detects faces 
+     * Returns newest camera frame and detects faces. Frames grabbed while the previous one
+     * was being processed are dropped. The frame stays valid until the next call
      */
     void operator>>(cv::Mat &frame);
 
+    /*
+     * Returns cv::getTickCount() value from the moment the last returned frame was grabbed
+     */
+    int64 frameCaptureTicks() const;
+
+    /*
+     * Returns number of camera frames dropped because a newer frame arrived before they were processed
+     */
+    size_t droppedFrames() const;
+
+    /*
+     * Returns number of frames grabbed from the camera
+     */
+    size_t capturedFrames() const;
+
+    /*
+     * Returns time in seconds spent detecting or tracking faces in the last frame, not counting the wait for the camera
+     */
+    double detectionTime() const;
+
+    /*
+     * Changes width of the frame faces are detected on. Faces being tracked are carried over to the new size
+     */
+    void setDownscaledFrameWidth(int width);
+
+    /*
+     * Sets cascade scale factor and minimum neighbors used in detection and tracking
+     */
+    void setScanParameters(double scaleFactor, int minNeighbors);
+
     /*
      * Returns vector of detected faces
      */
     std::vector<cv::Rect> faces();
 
+    /*
+     * Returns size of camera frames
+     */
+    cv::Size frameSize() const;
+
+    /*
+     * Returns frames per second delivered by the camera, measured if the camera doesn't report it
+     */
+    double frameRate() const;
+
+    /*
+     * Grabs numSampleFrames camera frames, times every candidate detector on them and switches to
+     * the fastest one that finds at least minRecall of the faces found by the first candidate
+     */
+    void calibrate(std::vector<std::unique_ptr<FaceDetector>> candidates, size_t numSampleFrames, double minRecall);
+
 private:
+    /* Opens camera and initializes frame sizes */
+    void init(const int cameraIndex, size_t numFaces);
+
     void detect();
     void track();
 
+    /* Recalculates downscaled frame size and ratio from m_downscaledFrameWidth */
+    void updateDownscaledFrameSize();
+
+    /*
+     * Searches for lost faces around positions predicted by their motion models and
+     * re-associates identities by proximity and appearance. Falls back to full frame
+     * search after m_maxRecoveryFrames frames
+     */
+    void recover();
+
+    /* Initializes templates, ROIs and timers for faces in m_facesRects and turns on tracking */
+    void startTracking();
+
+    /* Stops tracking but keeps motion models and templates for recover() */
+    void loseFaces();
+
+    /* Returns how much candidate differs from template of face at faceIndex, 0 is identical */
+    double appearanceCost(size_t faceIndex, const cv::Rect &candidate);
+
+    /* Returns constant velocity Kalman filter initialized at face */
+    static cv::KalmanFilter createMotionModel(const cv::Rect &face);
+    static cv::Rect rectFromState(const cv::Mat &state);
+    static cv::Mat measurementFromRect(const cv::Rect &face);
+
+    /* Returns inner half of face used as template */
+    static cv::Rect templateRect(cv::Rect face);
+
     /* Returns double inputRect size centered around the same point */
     static cv::Rect doubleRectSize(const cv::Rect &rect, const cv::Size &frameSize);
 
+    /* Returns inputRect scaled by scale centered around the same point, clipped to frame */
+    static cv::Rect scaleRect(const cv::Rect &rect, double scale, const cv::Size &frameSize);
+
+    /* Minimum and maximum face size searched for in full frame detection */
+    cv::Size minFaceSize() const;
+    cv::Size maxFaceSize() const;
+
     /*
      * Private members
      */
 
     /*
-     * Video capture object used for retrieving camera frames
+     * Capture thread used for retrieving camera frames
+     */
+    std::unique_ptr<CameraCapture> m_camera;
+
+    /*
+     * Capture time of the last returned frame
      */
-    std::unique_ptr<cv::VideoCapture> m_camera;
+    int64 m_frameCaptureTicks = 0;
 
     /*
-     * Cascade classifier object used for detecting faces in frames
+     * Detector backend used for detecting faces in frames
      */
-    std::unique_ptr<cv::CascadeClassifier> m_faceCascade;
+    std::unique_ptr<FaceDetector> m_detector;
 
     /*
      * Downscaled camera frame. Downscaling speeds up detection 
@@ -61,7 +159,18 @@ private:
     /*
      * Width of downscaled camera frame. Height is calculated to preserve aspect ratio
      */
-    static const int m_downscaledFrameWidth = 256;
+    int m_downscaledFrameWidth = 256;
+
+    /*
+     * Scan parameters passed to the detector, kept so they survive switching detectors in calibrate()
+     */
+    double m_scaleFactor = 1.1;
+    int m_minNeighbors = 3;
+
+    /*
+     * Time spent in detection or tracking for the last frame
+     */
+    double m_detectionTime = 0;
 
     /*
      * Vector of rectangles representing faces in camera frame
@@ -82,6 +191,18 @@ private:
     std::vector<cv::Rect>                   m_faceRois;
 
     cv::Mat                                 m_matchingResult;
+    cv::Mat                                 m_candidateTemplate;
+
+    /*
+     * Constant velocity motion model per face. Kept while faces are lost so identities survive recovery
+     */
+    std::vector<cv::KalmanFilter>           m_faceMotions;
+
+    int                                     m_recoveryFrames = 0;
+    const int                               m_maxRecoveryFrames = 30;
+    const double                            m_recoverySearchGrowth = 0.25;
+    const double                            m_maxRecoverySearchScale = 4.0;
+    const double                            m_appearanceWeight = 1.0;
 
     cv::Size                                m_downscaledFrameSize;
     cv::Size                                m_originalFrameSize;
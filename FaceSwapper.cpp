@@ -1,5 +1,8 @@
 #include "FaceSwapper.h"
 
+#include <algorithm>
+#include <cstring>
+#include <functional>
 #include <iostream>
 
 FaceSwapper::FaceSwapper(const std::string landmarks_path)
@@ -53,6 +56,11 @@ void FaceSwapper::swapFaces(cv::Mat &frame, cv::Rect &rect_ann, cv::Rect &rect_b
     pasteFacesOnFrame();
 }
 
+void FaceSwapper::setFeatherDivisor(int feather_divisor)
+{
+    this->feather_divisor = std::max(feather_divisor, 1);
+}
+
 cv::Mat FaceSwapper::getMinFrame(const cv::Mat &frame, cv::Rect &rect_ann, cv::Rect &rect_bob)
 {
     cv::Rect bounding_rect = rect_ann | rect_bob;
@@ -122,7 +130,7 @@ void FaceSwapper::getFacePoints(const cv::Mat &frame)
     affine_transform_keypoints_bob[1] = getPoint(1, 36);
     affine_transform_keypoints_bob[2] = getPoint(1, 45);
 
-    feather_amount.width = feather_amount.height = (int)cv::norm(points_ann[0] - points_ann[6]) / 8;
+    feather_amount.width = feather_amount.height = std::max((int)cv::norm(points_ann[0] - points_ann[6]) / feather_divisor, 1);
 }
 
 void FaceSwapper::getTransformationMatrices()
@@ -183,68 +191,182 @@ void FaceSwapper::colorCorrectFaces()
     specifiyHistogram(small_frame(big_rect_bob), warpped_faces(big_rect_bob), warpped_mask_ann(big_rect_bob));
 }
 
+int FaceSwapper::numRowTiles(int rows, int cols)
+{
+    // Small ROIs stay serial, thread wake up costs more than the work. Without a parallel
+    // backend tiles would run one after another and only add mask copies and histogram merging
+    if (rows * cols < min_parallel_pixels || cv::getNumThreads() <= 1)
+    {
+        return 1;
+    }
+    return std::max(std::min(rows / min_tile_rows, cv::getNumThreads() * tiles_per_thread), 1);
+}
+
+namespace
+{
+    // Calls body for each tile index in range. Wraps a lambda for cv::parallel_for_ which
+    // only takes lambdas directly since OpenCV 3.3
+    template<typename Body>
+    class RowTileLoop : public cv::ParallelLoopBody
+    {
+    public:
+        RowTileLoop(int rows, int num_tiles, const Body &body) : rows(rows), num_tiles(num_tiles), body(body) {}
+
+        void operator()(const cv::Range &tiles) const override
+        {
+            for (int tile = tiles.start; tile < tiles.end; tile++)
+            {
+                body(tile, cv::Range(rows * tile / num_tiles, rows * (tile + 1) / num_tiles));
+            }
+        }
+
+    private:
+        int rows;
+        int num_tiles;
+        const Body &body;
+    };
+}
+
+template<typename Body>
+void FaceSwapper::forEachRowTile(int rows, int num_tiles, const Body &body)
+{
+    if (num_tiles <= 1)
+    {
+        body(0, cv::Range(0, rows));
+        return;
+    }
+
+    // OpenCV hands tiles to its thread pool (work stealing with the TBB backend)
+    cv::parallel_for_(cv::Range(0, num_tiles), RowTileLoop<Body>(rows, num_tiles, body), num_tiles);
+}
+
 void FaceSwapper::featherMask(cv::Mat &refined_masks)
 {
-    cv::erode(refined_masks, refined_masks, getStructuringElement(cv::MORPH_RECT, feather_amount), cv::Point(-1, -1), 1, cv::BORDER_CONSTANT, cv::Scalar(0));
+    int num_tiles = numRowTiles(refined_masks.rows, refined_masks.cols);
+    if (num_tiles <= 1)
+    {
+        cv::erode(refined_masks, refined_masks, getStructuringElement(cv::MORPH_RECT, feather_amount), cv::Point(-1, -1), 1, cv::BORDER_CONSTANT, cv::Scalar(0));
+
+        cv::blur(refined_masks, refined_masks, feather_amount, cv::Point(-1, -1), cv::BORDER_CONSTANT);
+        return;
+    }
 
-    cv::blur(refined_masks, refined_masks, feather_amount, cv::Point(-1, -1), cv::BORDER_CONSTANT);
+    // Tiles can't filter in place because they read rows their neighbours write, so each pass reads from
+    // a copy of the mask. The copy keeps a feather_amount margin of the surrounding frame so filtering
+    // sees the same pixels past the mask edges as the serial version does
+    auto filterTiles = [&](const std::function<void(const cv::Mat &, cv::Mat &)> &filter)
+    {
+        cv::Mat source_with_margin = refined_masks;
+        source_with_margin.adjustROI(feather_amount.height, feather_amount.height, feather_amount.width, feather_amount.width);
+
+        cv::Size whole_size, margin_whole_size;
+        cv::Point offset, margin_offset;
+        refined_masks.locateROI(whole_size, offset);
+        source_with_margin.locateROI(margin_whole_size, margin_offset);
+
+        source_with_margin.copyTo(feather_source);
+        const cv::Mat source = feather_source(cv::Rect(offset - margin_offset, refined_masks.size()));
+
+        forEachRowTile(refined_masks.rows, num_tiles, [&](int, const cv::Range &rows)
+        {
+            cv::Mat tile = refined_masks.rowRange(rows);
+            filter(source.rowRange(rows), tile);
+        });
+    };
+
+    const cv::Mat kernel = getStructuringElement(cv::MORPH_RECT, feather_amount);
+    filterTiles([&](const cv::Mat &source, cv::Mat &tile)
+    {
+        cv::erode(source, tile, kernel, cv::Point(-1, -1), 1, cv::BORDER_CONSTANT, cv::Scalar(0));
+    });
+    filterTiles([&](const cv::Mat &source, cv::Mat &tile)
+    {
+        cv::blur(source, tile, feather_amount, cv::Point(-1, -1), cv::BORDER_CONSTANT);
+    });
 }
 
 inline void FaceSwapper::pasteFacesOnFrame()
 {
-    for (size_t i = 0; i < small_frame.rows; i++)
+    // Rows are independent so tiles need no synchronization
+    forEachRowTile(small_frame.rows, numRowTiles(small_frame.rows, small_frame.cols), [&](int, const cv::Range &rows)
     {
-        auto frame_pixel = small_frame.row(i).data;
-        auto faces_pixel = warpped_faces.row(i).data;
-        auto masks_pixel = refined_masks.row(i).data;
-
-        for (size_t j = 0; j < small_frame.cols; j++)
+        for (int i = rows.start; i < rows.end; i++)
         {
-            if (*masks_pixel != 0)
+            auto frame_pixel = small_frame.row(i).data;
+            auto faces_pixel = warpped_faces.row(i).data;
+            auto masks_pixel = refined_masks.row(i).data;
+
+            for (size_t j = 0; j < small_frame.cols; j++)
             {
-                *frame_pixel = ((255 - *masks_pixel) * (*frame_pixel) + (*masks_pixel) * (*faces_pixel)) >> 8; // divide by 256
-                *(frame_pixel + 1) = ((255 - *(masks_pixel + 1)) * (*(frame_pixel + 1)) + (*(masks_pixel + 1)) * (*(faces_pixel + 1))) >> 8;
-                *(frame_pixel + 2) = ((255 - *(masks_pixel + 2)) * (*(frame_pixel + 2)) + (*(masks_pixel + 2)) * (*(faces_pixel + 2))) >> 8;
+                if (*masks_pixel != 0)
+                {
+                    *frame_pixel = ((255 - *masks_pixel) * (*frame_pixel) + (*masks_pixel) * (*faces_pixel)) >> 8; // divide by 256
+                    *(frame_pixel + 1) = ((255 - *(masks_pixel + 1)) * (*(frame_pixel + 1)) + (*(masks_pixel + 1)) * (*(faces_pixel + 1))) >> 8;
+                    *(frame_pixel + 2) = ((255 - *(masks_pixel + 2)) * (*(frame_pixel + 2)) + (*(masks_pixel + 2)) * (*(faces_pixel + 2))) >> 8;
+                }
+
+                frame_pixel += 3;
+                faces_pixel += 3;
+                masks_pixel++;
             }
-
-            frame_pixel += 3;
-            faces_pixel += 3;
-            masks_pixel++;
         }
-    }
+    });
 }
 
 void FaceSwapper::specifiyHistogram(const cv::Mat source_image, cv::Mat target_image, cv::Mat mask)
 {
+    const int num_tiles = numRowTiles(mask.rows, mask.cols);
 
-    std::memset(source_hist_int, 0, sizeof(int) * 3 * 256);
-    std::memset(target_hist_int, 0, sizeof(int) * 3 * 256);
+    // Each tile counts into its own histograms which are summed afterwards
+    tile_hists.assign(num_tiles * 6 * 256, 0);
 
-    for (size_t i = 0; i < mask.rows; i++)
+    forEachRowTile(mask.rows, num_tiles, [&](int tile, const cv::Range &rows)
     {
-        auto current_mask_pixel = mask.row(i).data;
-        auto current_source_pixel = source_image.row(i).data;
-        auto current_target_pixel = target_image.row(i).data;
+        int (*tile_source_hist)[256] = reinterpret_cast<int (*)[256]>(&tile_hists[tile * 6 * 256]);
+        int (*tile_target_hist)[256] = tile_source_hist + 3;
 
-        for (size_t j = 0; j < mask.cols; j++)
+        for (int i = rows.start; i < rows.end; i++)
         {
-            if (*current_mask_pixel != 0) {
-                source_hist_int[0][*current_source_pixel]++;
-                source_hist_int[1][*(current_source_pixel + 1)]++;
-                source_hist_int[2][*(current_source_pixel + 2)]++;
-
-                target_hist_int[0][*current_target_pixel]++;
-                target_hist_int[1][*(current_target_pixel + 1)]++;
-                target_hist_int[2][*(current_target_pixel + 2)]++;
+            auto current_mask_pixel = mask.row(i).data;
+            auto current_source_pixel = source_image.row(i).data;
+            auto current_target_pixel = target_image.row(i).data;
+
+            for (size_t j = 0; j < mask.cols; j++)
+            {
+                if (*current_mask_pixel != 0) {
+                    tile_source_hist[0][*current_source_pixel]++;
+                    tile_source_hist[1][*(current_source_pixel + 1)]++;
+                    tile_source_hist[2][*(current_source_pixel + 2)]++;
+
+                    tile_target_hist[0][*current_target_pixel]++;
+                    tile_target_hist[1][*(current_target_pixel + 1)]++;
+                    tile_target_hist[2][*(current_target_pixel + 2)]++;
+                }
+
+                // Advance to next pixel
+                current_source_pixel += 3; 
+                current_target_pixel += 3; 
+                current_mask_pixel++; 
             }
+        }
+    });
+
+    // Reduce tile histograms
+    std::memset(source_hist_int, 0, sizeof(int) * 3 * 256);
+    std::memset(target_hist_int, 0, sizeof(int) * 3 * 256);
 
-            // Advance to next pixel
-            current_source_pixel += 3; 
-            current_target_pixel += 3; 
-            current_mask_pixel++; 
+    for (int tile = 0; tile < num_tiles; tile++)
+    {
+        const int *tile_hist = &tile_hists[tile * 6 * 256];
+        for (size_t c = 0; c < 3; c++)
+        {
+            for (size_t i = 0; i < 256; i++)
+            {
+                source_hist_int[c][i] += tile_hist[c * 256 + i];
+                target_hist_int[c][i] += tile_hist[(c + 3) * 256 + i];
+            }
         }
     }
-
     // Calc CDF
     for (size_t i = 1; i < 256; i++)
     {
@@ -294,22 +416,25 @@ void FaceSwapper::specifiyHistogram(const cv::Mat source_image, cv::Mat target_i
     }
 
     // repaint pixels
-    for (size_t i = 0; i < mask.rows; i++)
+    forEachRowTile(mask.rows, num_tiles, [&](int, const cv::Range &rows)
     {
-        auto current_mask_pixel = mask.row(i).data;
-        auto current_target_pixel = target_image.row(i).data;
-        for (size_t j = 0; j < mask.cols; j++)
+        for (int i = rows.start; i < rows.end; i++)
         {
-            if (*current_mask_pixel != 0)
+            auto current_mask_pixel = mask.row(i).data;
+            auto current_target_pixel = target_image.row(i).data;
+            for (size_t j = 0; j < mask.cols; j++)
             {
-                *current_target_pixel = LUT[0][*current_target_pixel];
-                *(current_target_pixel + 1) = LUT[1][*(current_target_pixel + 1)];
-                *(current_target_pixel + 2) = LUT[2][*(current_target_pixel + 2)];
+                if (*current_mask_pixel != 0)
+                {
+                    *current_target_pixel = LUT[0][*current_target_pixel];
+                    *(current_target_pixel + 1) = LUT[1][*(current_target_pixel + 1)];
+                    *(current_target_pixel + 2) = LUT[2][*(current_target_pixel + 2)];
+                }
+
+                // Advance to next pixel
+                current_target_pixel += 3;
+                current_mask_pixel++;
             }
-
-            // Advance to next pixel
-            current_target_pixel += 3;
-            current_mask_pixel++;
         }
-    }
+    });
 }
@@ -24,6 +24,9 @@ public:
     //Swaps faces in rects on frame
     void swapFaces(cv::Mat &frame, cv::Rect &rect_ann, cv::Rect &rect_bob);
 
+    // Sets feather amount as face width divided by feather_divisor. Bigger divisor is faster
+    void setFeatherDivisor(int feather_divisor);
+
 private:
     // Returns minimal Mat containing both faces
     cv::Mat getMinFrame(const cv::Mat &frame, cv::Rect &rect_ann, cv::Rect &rect_bob);
@@ -61,6 +64,13 @@ private:
     // Calculates source image histogram and changes target_image to match source hist
     void specifiyHistogram(const cv::Mat source_image, cv::Mat target_image, cv::Mat mask);
 
+    // Returns number of row tiles to split a rows x cols region into, 1 if it should stay serial
+    static int numRowTiles(int rows, int cols);
+
+    // Calls body(tile_index, row_range) for each of num_tiles row tiles in parallel
+    template<typename Body>
+    static void forEachRowTile(int rows, int num_tiles, const Body &body);
+
     cv::Rect rect_ann, rect_bob;
     cv::Rect big_rect_ann, big_rect_bob;
 
@@ -86,10 +96,17 @@ private:
     cv::Size frame_size;
 
     cv::Size feather_amount;
+    int feather_divisor = 8;
 
     uint8_t LUT[3][256];
     int source_hist_int[3][256];
     int target_hist_int[3][256];
+    std::vector<int> tile_hists;
+    cv::Mat feather_source;
+
+    static const int min_parallel_pixels = 128 * 128;
+    static const int min_tile_rows = 16;
+    static const int tiles_per_thread = 4;
     float source_histogram[3][256];
     float target_histogram[3][256];
 };
@@ -0,0 +1,228 @@
+#include "FrameSink.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include <algorithm>
+#include <csignal>
+#include <iostream>
+
+/* Returns true if path ends with suffix */
+static bool endsWith(const std::string &path, const std::string &suffix)
+{
+    return path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+FrameSink::FrameSink(const std::string &path, double fps, Backpressure backpressure, size_t numBuffers)
+    : m_path(path), m_fps(fps), m_backpressure(backpressure), m_numBuffers(std::max(numBuffers, (size_t)1)), m_failed(false),
+    m_framesWritten(0), m_framesDropped(0), m_framesRejected(0), m_bytesWritten(0), m_writeTicks(0)
+{
+    if (endsWith(path, ".bgr") || endsWith(path, ".raw"))
+    {
+#ifdef SIGPIPE
+        // A downstream encoder closing the pipe should fail the write, not kill the process
+        std::signal(SIGPIPE, SIG_IGN);
+#endif
+        m_rawPipe = std::fopen(path.c_str(), "wb");
+        if (m_rawPipe == nullptr)
+        {
+            std::cerr << "Failed opening output pipe " << path << std::endl;
+            return;
+        }
+    }
+
+    m_writerThread = std::thread(&FrameSink::writeLoop, this);
+}
+
+bool FrameSink::openForFrameSize(const cv::Size &frameSize)
+{
+    // Cameras often report a size different from the frames they deliver, so nothing is sized before the first frame
+    if (m_rawPipe == nullptr)
+    {
+#if CV_VERSION_MAJOR < 3
+        int fourcc = endsWith(m_path, ".mp4") ? CV_FOURCC('m', 'p', '4', 'v') : CV_FOURCC('M', 'J', 'P', 'G');
+#else
+        int fourcc = endsWith(m_path, ".mp4") ? cv::VideoWriter::fourcc('m', 'p', '4', 'v') : cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
+#endif
+        m_videoWriter = std::make_unique<cv::VideoWriter>(m_path, fourcc, m_fps, frameSize);
+        if (m_videoWriter->isOpened() == false)
+        {
+            std::cerr << "Failed opening output video " << m_path << std::endl;
+            return false;
+        }
+    }
+
+    // Allocate all buffers now so later writes never allocate
+    m_buffers.resize(m_numBuffers);
+    for (size_t i = 0; i < m_buffers.size(); i++)
+    {
+        m_buffers[i].create(frameSize, CV_8UC3);
+        m_freeBuffers.push_back(i);
+    }
+
+    m_frameSize = frameSize;
+    std::cout << "Writing " << frameSize.width << "x" << frameSize.height << " frames at " << m_fps << " fps to " << m_path << std::endl;
+    return true;
+}
+
+FrameSink::~FrameSink()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_frameQueued.notify_one();
+
+    if (m_writerThread.joinable())
+    {
+        m_writerThread.join();
+    }
+
+    if (m_rawPipe != nullptr)
+    {
+        std::fclose(m_rawPipe);
+    }
+    // cv::VideoWriter finalizes the file when destroyed
+}
+
+bool FrameSink::isOpened() const
+{
+    return m_writerThread.joinable();
+}
+
+bool FrameSink::failed() const
+{
+    return m_failed;
+}
+
+bool FrameSink::write(const cv::Mat &frame)
+{
+    if (m_failed || !isOpened())
+    {
+        return false;
+    }
+
+    // Copying a different frame would reallocate the buffer and the output would no longer match the opened size
+    if (frame.type() != CV_8UC3 || frame.empty() || (m_frameSize.area() > 0 && frame.size() != m_frameSize))
+    {
+        if (m_framesRejected++ == 0)
+        {
+            std::cerr << "Rejecting frames that aren't CV_8UC3 of the first frame size " << m_frameSize << std::endl;
+        }
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_frameSize.area() == 0 && !openForFrameSize(frame.size()))
+    {
+        m_failed = true;
+        return false;
+    }
+
+    if (m_freeBuffers.empty())
+    {
+        if (m_backpressure == Backpressure::Drop)
+        {
+            m_framesDropped++;
+            return false;
+        }
+        m_bufferFreed.wait(lock, [&] { return !m_freeBuffers.empty() || m_failed; });
+        if (m_failed)
+        {
+            return false;
+        }
+    }
+
+    size_t index = m_freeBuffers.back();
+    m_freeBuffers.pop_back();
+
+    // The buffer belongs to us until it is queued so the copy doesn't need the lock
+    lock.unlock();
+    frame.copyTo(m_buffers[index]);
+    lock.lock();
+
+    m_queuedBuffers.push_back(index);
+    lock.unlock();
+    m_frameQueued.notify_one();
+    return true;
+}
+
+size_t FrameSink::framesWritten() const
+{
+    return m_framesWritten;
+}
+
+size_t FrameSink::framesDropped() const
+{
+    return m_framesDropped;
+}
+
+size_t FrameSink::framesRejected() const
+{
+    return m_framesRejected;
+}
+
+size_t FrameSink::bytesWritten() const
+{
+    return m_bytesWritten;
+}
+
+double FrameSink::averageWriteTime() const
+{
+    size_t frames = m_framesWritten;
+    return frames ? m_writeTicks / cv::getTickFrequency() / frames : 0.0;
+}
+
+void FrameSink::writeLoop()
+{
+    while (true)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_frameQueued.wait(lock, [&] { return !m_queuedBuffers.empty() || m_stopping; });
+        if (m_queuedBuffers.empty()) // Stopping and every queued frame is written
+        {
+            break;
+        }
+
+        size_t index = m_queuedBuffers.front();
+        m_queuedBuffers.pop_front();
+        lock.unlock();
+
+        auto timeStart = cv::getTickCount();
+        bool written = writeFrame(m_buffers[index]);
+        m_writeTicks += cv::getTickCount() - timeStart;
+
+        lock.lock();
+        m_freeBuffers.push_back(index);
+        if (written)
+        {
+            m_framesWritten++;
+            m_bytesWritten += m_buffers[index].total() * m_buffers[index].elemSize();
+        }
+        else
+        {
+            m_failed = true;
+        }
+        lock.unlock();
+        m_bufferFreed.notify_one();
+
+        if (!written)
+        {
+            std::cerr << "Failed writing frame, output closed" << std::endl;
+            break;
+        }
+    }
+}
+
+bool FrameSink::writeFrame(const cv::Mat &frame)
+{
+    if (m_rawPipe != nullptr)
+    {
+        const size_t frameBytes = frame.total() * frame.elemSize();
+        return std::fwrite(frame.data, 1, frameBytes, m_rawPipe) == frameBytes;
+    }
+
+    // write() only queues frames matching the size the writer was opened with so they aren't skipped
+    *m_videoWriter << frame;
+    return true;
+}
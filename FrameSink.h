@@ -0,0 +1,117 @@
+#pragma once
+
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cv
+{
+    class VideoWriter;
+}
+
+/*
+ * Writes frames to an encoded video file or a raw BGR pipe on a dedicated thread.
+ * Frames are copied once into a bounded pool of recycled buffers and the writer
+ * thread encodes straight from those buffers
+ */
+class FrameSink
+{
+public:
+    /*
+     * What write() does when all buffers are waiting to be written
+     */
+    enum class Backpressure
+    {
+        Block,  // Wait for the writer thread to free a buffer
+        Drop    // Drop the frame and return immediately
+    };
+
+    /*
+     * Opens output at path and starts writer thread. Paths ending with .bgr or .raw (for example a FIFO
+     * made with mkfifo) receive raw BGR24 frames, anything else is encoded with cv::VideoWriter.
+     * Buffers and the video encoder are sized from the first frame passed to write()
+     */
+    FrameSink(const std::string &path, double fps, Backpressure backpressure, size_t numBuffers);
+
+    /*
+     * Writes all queued frames and closes the output
+     */
+    ~FrameSink();
+
+    bool isOpened() const;
+
+    /*
+     * Returns true once the output failed and no more frames can be written
+     */
+    bool failed() const;
+
+    /*
+     * Queues frame for writing. Frame must be CV_8UC3, and every frame must have the size of the first one.
+     * Returns false if the frame was rejected, dropped or the output failed
+     */
+    bool write(const cv::Mat &frame);
+
+    /*
+     * Throughput counters. Bytes are uncompressed frame bytes handed to the output
+     */
+    size_t framesWritten() const;
+    size_t framesDropped() const;
+    size_t framesRejected() const;
+    size_t bytesWritten() const;
+
+    /*
+     * Returns average time in seconds the writer thread spends encoding and writing one frame
+     */
+    double averageWriteTime() const;
+
+private:
+    void writeLoop();
+
+    /* Allocates buffers and opens the video encoder for frames of frameSize. Returns false on failure */
+    bool openForFrameSize(const cv::Size &frameSize);
+
+    /* Encodes or writes one frame. Returns false on output error */
+    bool writeFrame(const cv::Mat &frame);
+
+    std::unique_ptr<cv::VideoWriter> m_videoWriter;
+    FILE *m_rawPipe = nullptr;
+    std::string m_path;
+    double m_fps;
+
+    Backpressure m_backpressure;
+    size_t m_numBuffers;
+
+    /*
+     * Size of the first written frame, empty until then
+     */
+    cv::Size m_frameSize;
+
+    /*
+     * Frame buffers. Indices of buffers that can be filled are in m_freeBuffers,
+     * indices of filled buffers waiting for the writer thread are in m_queuedBuffers
+     */
+    std::vector<cv::Mat> m_buffers;
+    std::vector<size_t> m_freeBuffers;
+    std::deque<size_t> m_queuedBuffers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_bufferFreed;
+    std::condition_variable m_frameQueued;
+    bool m_stopping = false;
+    std::atomic<bool> m_failed;
+
+    std::thread m_writerThread;
+
+    std::atomic<size_t> m_framesWritten;
+    std::atomic<size_t> m_framesDropped;
+    std::atomic<size_t> m_framesRejected;
+    std::atomic<size_t> m_bytesWritten;
+    std::atomic<long long> m_writeTicks;
+};
@@ -0,0 +1,103 @@
+#include "QualityController.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+QualityController::QualityController(double targetFps, const QualitySettings &best, const QualitySettings &fastest, int numLevels)
+    : m_best(best), m_fastest(fastest), m_targetFrameTime(1.0 / targetFps), m_numLevels(std::max(numLevels, 1))
+{
+    applyLevels();
+}
+
+bool QualityController::update(double detectionTime, double swapTime)
+{
+    if (m_framesSinceAdjustment == 0)
+    {
+        m_detectionTime = detectionTime;
+        m_swapTime = swapTime;
+    }
+    else
+    {
+        m_detectionTime = (15 * m_detectionTime + detectionTime) / 16;
+        m_swapTime = (15 * m_swapTime + swapTime) / 16;
+    }
+
+    if (++m_framesSinceAdjustment < m_cooldownFrames)
+    {
+        return false;
+    }
+
+    const double frameTime = m_detectionTime + m_swapTime;
+    const int maxLevel = m_numLevels - 1;
+    const int oldDetectionLevel = m_detectionLevel;
+    const int oldSwapLevel = m_swapLevel;
+
+    if (frameTime > m_targetFrameTime * (1 + m_overloadMargin))
+    {
+        // Lower quality of the slower stage first
+        bool detectionSlower = m_detectionTime >= m_swapTime;
+        if ((detectionSlower && m_detectionLevel < maxLevel) || m_swapLevel == maxLevel)
+        {
+            m_detectionLevel = std::min(m_detectionLevel + 1, maxLevel);
+        }
+        else
+        {
+            m_swapLevel = std::min(m_swapLevel + 1, maxLevel);
+        }
+    }
+    else if (frameTime < m_targetFrameTime * (1 - m_headroomMargin))
+    {
+        // Restore the more degraded stage first
+        if (m_detectionLevel > 0 && m_detectionLevel >= m_swapLevel)
+        {
+            m_detectionLevel--;
+        }
+        else if (m_swapLevel > 0)
+        {
+            m_swapLevel--;
+        }
+    }
+
+    if (m_detectionLevel == oldDetectionLevel && m_swapLevel == oldSwapLevel)
+    {
+        return false;
+    }
+
+    const QualitySettings old = m_settings;
+    applyLevels();
+    m_framesSinceAdjustment = 0;
+
+    const bool lowered = m_detectionLevel > oldDetectionLevel || m_swapLevel > oldSwapLevel;
+    std::cout << "Quality " << (lowered ? "lowered" : "raised")
+        << " (detection " << m_detectionTime * 1000 << " ms, swap " << m_swapTime * 1000 << " ms, target " << m_targetFrameTime * 1000 << " ms):"
+        << " width " << old.downscaledFrameWidth << " -> " << m_settings.downscaledFrameWidth
+        << ", scale factor " << old.scaleFactor << " -> " << m_settings.scaleFactor
+        << ", min neighbors " << old.minNeighbors << " -> " << m_settings.minNeighbors
+        << ", feather divisor " << old.featherDivisor << " -> " << m_settings.featherDivisor << std::endl;
+
+    return true;
+}
+
+const QualitySettings &QualityController::settings() const
+{
+    return m_settings;
+}
+
+void QualityController::applyLevels()
+{
+    // Coarser scale factor gives fewer overlapping hits per face so min neighbors drops with it to keep recall
+    m_settings.downscaledFrameWidth = (int)std::lround(interpolate(m_best.downscaledFrameWidth, m_fastest.downscaledFrameWidth, m_detectionLevel));
+    m_settings.scaleFactor = interpolate(m_best.scaleFactor, m_fastest.scaleFactor, m_detectionLevel);
+    m_settings.minNeighbors = (int)std::lround(interpolate(m_best.minNeighbors, m_fastest.minNeighbors, m_detectionLevel));
+    m_settings.featherDivisor = (int)std::lround(interpolate(m_best.featherDivisor, m_fastest.featherDivisor, m_swapLevel));
+}
+
+double QualityController::interpolate(double best, double fastest, int level) const
+{
+    if (m_numLevels == 1)
+    {
+        return best;
+    }
+    return best + (fastest - best) * level / (m_numLevels - 1);
+}
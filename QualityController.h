@@ -0,0 +1,81 @@
+#pragma once
+
+/*
+ * Cost parameters of the pipeline that can be traded for speed
+ */
+struct QualitySettings
+{
+    /*
+     * Width of the frame faces are detected on
+     */
+    int downscaledFrameWidth = 256;
+
+    /*
+     * Cascade scale factor and minimum neighbors used in detection and tracking
+     */
+    double scaleFactor = 1.1;
+    int minNeighbors = 3;
+
+    /*
+     * Face width is divided by this to get the mask feather amount. Bigger is cheaper
+     */
+    int featherDivisor = 8;
+};
+
+/*
+ * Feedback controller that adjusts QualitySettings to hold a target frame time.
+ * Detection and swap stages have separate quality levels, under load the level of the
+ * slower stage is lowered and when there is headroom again levels are restored.
+ * Level 0 uses the best settings and the last level uses the fastest settings
+ */
+class QualityController
+{
+public:
+    QualityController(double targetFps, const QualitySettings &best, const QualitySettings &fastest, int numLevels);
+
+    /*
+     * Reports time in seconds spent in detection and face swapping for the last frame.
+     * Returns true if settings changed
+     */
+    bool update(double detectionTime, double swapTime);
+
+    /*
+     * Returns current settings
+     */
+    const QualitySettings &settings() const;
+
+private:
+    /* Recalculates m_settings from the current levels */
+    void applyLevels();
+
+    /* Returns value between best and fastest for level */
+    double interpolate(double best, double fastest, int level) const;
+
+    QualitySettings m_best;
+    QualitySettings m_fastest;
+    QualitySettings m_settings;
+
+    double m_targetFrameTime;
+    int m_numLevels;
+
+    int m_detectionLevel = 0;
+    int m_swapLevel = 0;
+
+    /*
+     * Smoothed stage times
+     */
+    double m_detectionTime = 0;
+    double m_swapTime = 0;
+
+    /*
+     * Frames to wait after an adjustment so the smoothed times settle
+     */
+    int m_framesSinceAdjustment = 0;
+    const int m_cooldownFrames = 15;
+
+    /*
+     * Quality is lowered above target * (1 + m_overloadMargin) and restored below target * (1 - m_headroomMargin)
+     */
+    const double m_overloadMargin = 0.1;
+    const double m_headroomMargin = 0.25;
+};
@@ -1,44 +1,190 @@
 #include <opencv2/highgui/highgui.hpp>
 
+#include <atomic>
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+
+#include "FaceDetector.h"
 #include "FaceDetectorAndTracker.h"
 #include "FaceSwapper.h"
+#include "FrameSink.h"
+#include "QualityController.h"
 
 using namespace std;
 
-int main()
+// Set by Ctrl+C so headless runs can finish writing the output
+static atomic<bool> stop_requested(false);
+
+int main(int argc, char *argv[])
 {
     try
     {
+        const string usage = string("Usage: ") + argv[0] + " [haar|lbp|hog|dnn|auto] [target_fps] [output_path] [block|drop]";
+
+        // Detector backend: haar, lbp, hog, dnn or auto to pick the fastest one at startup
+        const string backend = argc > 1 ? argv[1] : "haar";
+        const string model_directory = "../";
+        if (backend != "haar" && backend != "lbp" && backend != "hog" && backend != "dnn" && backend != "auto")
+        {
+            cerr << "Unknown detector backend " << backend << endl << usage << endl;
+            return -1;
+        }
+
+        // Processing frame rate the quality controller tries to hold
+        double target_fps = 25.0;
+        if (argc > 2)
+        {
+            char *end = nullptr;
+            target_fps = strtod(argv[2], &end);
+            if (end == argv[2] || *end != '\0' || !isfinite(target_fps) || target_fps <= 0)
+            {
+                cerr << "Invalid target fps " << argv[2] << ", must be a positive number" << endl << usage << endl;
+                return -1;
+            }
+        }
+
+        // Optional output. Runs headless when set, .bgr or .raw paths receive raw BGR24 frames
+        const string output_path = argc > 3 ? argv[3] : "";
+        const FrameSink::Backpressure backpressure = (argc > 4 && string(argv[4]) == "drop") ? FrameSink::Backpressure::Drop : FrameSink::Backpressure::Block;
+
         const size_t num_faces = 2;
-        FaceDetectorAndTracker detector("../haarcascade_frontalface_default.xml", 0, num_faces);
+        unique_ptr<FaceDetectorAndTracker> detector_ptr;
+        if (backend == "auto")
+        {
+            // Calibration candidates ordered from most to least accurate, the first one is used as the recall reference.
+            // Backends whose model files are missing are left out
+            vector<unique_ptr<FaceDetector>> candidates;
+            for (const auto &name : { "dnn", "hog", "haar", "lbp" })
+            {
+                if (isFaceDetectorAvailable(name, model_directory))
+                {
+                    candidates.push_back(createFaceDetector(name, model_directory));
+                }
+            }
+
+            if (candidates.empty())
+            {
+                cerr << "No face detector backend is available, check model files in " << model_directory << endl;
+                return -1;
+            }
+
+            const size_t num_calibration_frames = 30;
+            const double min_recall = 0.8;
+            detector_ptr = make_unique<FaceDetectorAndTracker>(move(candidates), num_calibration_frames, min_recall, 0, num_faces);
+        }
+        else
+        {
+            auto face_detector = createFaceDetector(backend, model_directory);
+            if (!face_detector)
+            {
+                cerr << "Detector backend " << backend << " is not supported by this OpenCV build" << endl << usage << endl;
+                return -1;
+            }
+            detector_ptr = make_unique<FaceDetectorAndTracker>(move(face_detector), 0, num_faces);
+        }
+        FaceDetectorAndTracker &detector = *detector_ptr;
+
         FaceSwapper face_swapper("../shape_predictor_68_face_landmarks.dat");
 
+        // Quality bounds, level 0 is the best quality
+        QualitySettings best_quality;
+        QualitySettings fastest_quality;
+        fastest_quality.downscaledFrameWidth = 160;
+        fastest_quality.scaleFactor = 1.3;
+        fastest_quality.minNeighbors = 2;
+        fastest_quality.featherDivisor = 16;
+
+        const int num_quality_levels = 5;
+        QualityController quality_controller(target_fps, best_quality, fastest_quality, num_quality_levels);
+
+        auto applyQuality = [&](const QualitySettings &quality)
+        {
+            detector.setDownscaledFrameWidth(quality.downscaledFrameWidth);
+            detector.setScanParameters(quality.scaleFactor, quality.minNeighbors);
+            face_swapper.setFeatherDivisor(quality.featherDivisor);
+        };
+        applyQuality(quality_controller.settings());
+
+        unique_ptr<FrameSink> sink;
+        if (!output_path.empty())
+        {
+            // Frames are written as they arrive from the camera, so the output plays back at the camera rate.
+            // target_fps only drives quality and says nothing about how often frames are written
+            const double camera_fps = detector.frameRate();
+            const size_t num_output_buffers = 4;
+            sink = make_unique<FrameSink>(output_path, camera_fps > 0 ? camera_fps : target_fps, backpressure, num_output_buffers);
+            if (sink->isOpened() == false)
+            {
+                return -1;
+            }
+            // First Ctrl+C finishes the output, a second one kills the process in case
+            // write() is blocked on a stalled consumer and never gets back to the loop
+            signal(SIGINT, [](int)
+            {
+                stop_requested = true;
+                signal(SIGINT, SIG_DFL);
+            });
+        }
+
         double fps = 0;
-        while (true)
+        double latency_avg = 0;
+        while (!stop_requested)
         {
             auto time_start = cv::getTickCount();
 
-            // Grab a frame
+            // Grab the newest frame
             cv::Mat frame;
             detector >> frame;
+            if (frame.empty()) return 0;
 
+            auto swap_start = cv::getTickCount();
             auto cv_faces = detector.faces();
             if (cv_faces.size() == num_faces)
             {
                 face_swapper.swapFaces(frame, cv_faces[0], cv_faces[1]);
             }
+            auto swap_time = (cv::getTickCount() - swap_start) / cv::getTickFrequency();
+
+            if (quality_controller.update(detector.detectionTime(), swap_time))
+            {
+                applyQuality(quality_controller.settings());
+            }
 
             auto time_end = cv::getTickCount();
             auto time_per_frame = (time_end - time_start) / cv::getTickFrequency();
 
             fps = (15 * fps + (1 / time_per_frame)) / 16;
 
-            printf("Total time: %3.5f | FPS: %3.2f\n", time_per_frame, fps);
+            // Write it out or display it all on the screen
+            int key = -1;
+            if (sink)
+            {
+                if (!sink->write(frame) && sink->failed())
+                {
+                    break;
+                }
+            }
+            else
+            {
+                cv::imshow("Face Swap", frame);
+                key = cv::waitKey(1);
+            }
+
+            // Capture-to-display latency, measured from the moment the frame was grabbed
+            auto latency = (cv::getTickCount() - detector.frameCaptureTicks()) / cv::getTickFrequency();
+            latency_avg = (15 * latency_avg + latency) / 16;
 
-            // Display it all on the screen
-            cv::imshow("Face Swap", frame);
+            printf("Total time: %3.5f | FPS: %3.2f | Latency: %3.1f ms | Captured: %zu | Dropped: %zu", time_per_frame, fps, latency_avg * 1000,
+                detector.capturedFrames(), detector.droppedFrames());
+            if (sink)
+            {
+                printf(" | Written: %zu | Output dropped: %zu | Rejected: %zu | Write: %3.1f ms | %.1f MB", sink->framesWritten(), sink->framesDropped(),
+                    sink->framesRejected(), sink->averageWriteTime() * 1000, sink->bytesWritten() / (1024.0 * 1024.0));
+            }
+            printf("\n");
 
-            if (cv::waitKey(1) == 27) return 0;
+            if (key == 27) return 0;
         }
     }
     catch (exception& e)